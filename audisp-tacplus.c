@@ -35,6 +35,11 @@
  *   ausearch --start today --raw > test.log
  *   ./audisp-tacplus < test.log
  *
+ * To backfill accounting after the servers were unreachable, use replay
+ * mode, which reads the log directly, skips events already sent according
+ * to the checkpoint file, and sends the original event times:
+ *   ./audisp-tacplus --replay test.log --checkpoint test.ckpt
+ *
  * Excluding some init/destroy items you might need to add to main, the
  * event_handler function is the main place that you would modify to do
  * things specific to your plugin.
@@ -45,8 +50,17 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <limits.h>
 #include <inttypes.h>
 #include <signal.h>
 #include <string.h>
@@ -71,9 +85,95 @@ static unsigned connected_ok;
 
 char *configfile = "/etc/audisp/audisp-tac_plus.conf";
 
+/* send_tacacs_acct() results */
+#define ACCT_SENT 0 /* accepted by a server */
+#define ACCT_UNREACHABLE 1 /* no server answered */
+#define ACCT_REJECTED 2 /* a server answered, but didn't accept it */
+
+/*
+ * Replay (backfill) mode state.  Events are identified the same way the
+ * audit logs do, as audit(sec.milli:serial); serials restart at boot, so
+ * the time is compared first.
+ */
+typedef struct {
+    time_t sec;
+    unsigned milli;
+    unsigned long serial;
+    int valid;
+} replay_mark_t;
+
+/*
+ * An event in the log that hasn't been delivered yet.  It is added when
+ * its first record is fed to auparse, and removed once auparse has
+ * finished it and every record sent for it has been accepted.  The
+ * checkpoint is kept below the oldest of these, because auparse can
+ * finish a newer event while an older one is still being assembled.
+ */
+typedef struct replay_event {
+    replay_mark_t id;
+    unsigned pending; /* records handed to workers, not yet answered */
+    int parsed; /* auparse has finished with the event */
+    int undelivered; /* a record wasn't sent; stays open for the next run */
+    struct replay_event *prev, *next;
+} replay_event_t;
+
+/* an accounting record, handed to a worker process over a pipe */
+typedef struct {
+    replay_event_t *event; /* only used by the parent; echoed in the reply */
+    int type;
+    uint16_t taskid;
+    time_t evtime;
+    char user[256];
+    char tty[64];
+    char host[256];
+    char cmd[240];
+} replay_req_t;
+
+typedef struct {
+    replay_event_t *event;
+    int worker;
+    int status; /* ACCT_* */
+} replay_reply_t;
+
+typedef struct {
+    pid_t pid;
+    int fd; /* request pipe */
+    unsigned inflight; /* requests not yet answered */
+} replay_worker_t;
+
+#define REPLAY_CHUNK (64*1024) /* bytes handed to auparse per feed */
+#define REPLAY_CKPT_INTERVAL 64 /* events between checkpoint writes */
+#define REPLAY_MAX_JOBS 32
+#define REPLAY_INFLIGHT 32 /* requests queued per worker, must fit the pipe */
+
+static char *replayfile;
+static char *checkpointfile;
+static int replay_jobs = 4; /* worker processes sending records */
+static replay_mark_t skip_mark; /* checkpoint read at start; skip up to it */
+static replay_mark_t ckpt_mark; /* newest event delivered so far */
+static replay_mark_t open_max; /* newest event added to the open list */
+static replay_event_t *open_head, *open_tail; /* events not yet delivered */
+static replay_event_t *replay_cur; /* event handle_event() is working on */
+static replay_worker_t workers[REPLAY_MAX_JOBS];
+static int nworkers;
+static int reply_fd = -1; /* answers from all the workers */
+static unsigned ckpt_pending; /* events handled since last checkpoint write */
+static int replay_failed; /* a record couldn't be sent, replay stopped */
+static unsigned replay_rejected; /* records the servers rejected */
+static time_t boot_time; /* session ids before this belong to earlier boots */
+
 /* Local declarations */
 static void handle_event(auparse_state_t *au,
 		auparse_cb_event_t cb_event_type, void *user_data);
+static int replay_log(auparse_state_t *au);
+static void replay_msg(int level, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+static int replay_dispatch(char *user, char *tty, char *host, char *cmd,
+    int type, uint16_t taskid, time_t evtime);
+static int read_checkpoint(void);
+static int write_checkpoint(void);
+static int send_tacacs_acct(char *user, char *tty, char *host, char *cmdmsg,
+    int type, uint16_t task_id, time_t evtime);
 
 /*
  * SIGTERM handler
@@ -268,15 +368,56 @@ reload_config(void)
     audisp_tacplus_config(configfile, 0);
 }
 
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: %s [--replay logfile [--checkpoint file] "
+        "[--jobs N]] [config-file]\n", progname);
+}
+
 int
 main(int argc, char *argv[])
 {
 	char tmp[MAX_AUDIT_MESSAGE_LENGTH+1];
 	struct sigaction sa;
+	int c, rv = 0, jobs_set = 0;
+	static const struct option opts[] = {
+		{ "replay", required_argument, NULL, 'r' },
+		{ "checkpoint", required_argument, NULL, 'c' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while((c = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch(c) {
+		case 'r':
+			replayfile = optarg;
+			break;
+		case 'c':
+			checkpointfile = optarg;
+			break;
+		case 'j':
+			replay_jobs = (int)strtol(optarg, NULL, 0);
+			if(replay_jobs < 1 || replay_jobs > REPLAY_MAX_JOBS) {
+				fprintf(stderr, "%s: --jobs must be 1 to %d\n",
+					progname, REPLAY_MAX_JOBS);
+				return 1;
+			}
+			jobs_set = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if((checkpointfile || jobs_set) && !replayfile) {
+		usage();
+		return 1;
+	}
 
     /* if there is an argument, it is an alternate configuration file */
-    if(argc > 1)
-        configfile = argv[1];
+    if(optind < argc)
+        configfile = argv[optind];
     reload_config();
 
 	/* Register sighandlers */
@@ -285,6 +426,11 @@ main(int argc, char *argv[])
 	/* Set handler for the ones we care about */
 	sa.sa_handler = term_handler;
 	sigaction(SIGTERM, &sa, NULL);
+	if(replayfile) { /* run by hand; save the checkpoint on ^C as well */
+		sigaction(SIGINT, &sa, NULL);
+		sa.sa_handler = SIG_IGN; /* a dead worker is a write error */
+		sigaction(SIGPIPE, &sa, NULL);
+	}
 	sa.sa_handler = hup_handler;
 	sigaction(SIGHUP, &sa, NULL);
 
@@ -295,6 +441,26 @@ main(int argc, char *argv[])
 		return -1;
 	}
 	auparse_add_callback(au, handle_event, NULL, NULL);
+
+	if(replayfile) {
+		struct timespec up;
+
+		if(read_checkpoint()) {
+			auparse_destroy(au);
+			return 1;
+		}
+		ckpt_mark = skip_mark;
+		if(!clock_gettime(CLOCK_BOOTTIME, &up))
+			boot_time = time(NULL) - up.tv_sec;
+		rv = replay_log(au);
+		auparse_destroy(au);
+		rv |= write_checkpoint();
+		if(replay_rejected)
+			replay_msg(LOG_WARNING, "%u records rejected by the "
+				"server were skipped", replay_rejected);
+		return rv || replay_failed || replay_rejected;
+	}
+
 	do {
 		/* Load configuration */
 		if(hup) {
@@ -325,18 +491,574 @@ main(int argc, char *argv[])
 	return 0;
 }
 
+/*
+ * Replay is run by hand, so problems are reported on stderr as well as
+ * to syslog.  %m works in fmt, as it does for syslog.
+ */
+static void
+replay_msg(int level, const char *fmt, ...)
+{
+    va_list ap;
+    char buf[512];
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "%s: %s\n", progname, buf);
+    syslog(level, "%s: %s", progname, buf);
+}
+
+static int
+replay_cmp(const replay_mark_t *a, const replay_mark_t *b)
+{
+    if(a->sec != b->sec)
+        return a->sec < b->sec ? -1 : 1;
+    if(a->milli != b->milli)
+        return a->milli < b->milli ? -1 : 1;
+    if(a->serial != b->serial)
+        return a->serial < b->serial ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Returns 1 if id is newer than the mark (or the mark isn't set).
+ */
+static int
+replay_is_newer(const replay_mark_t *id, const replay_mark_t *mark)
+{
+    return !mark->valid || replay_cmp(id, mark) > 0;
+}
+
+/*
+ * Parse the "sec.milli:serial)" following "msg=audit(", without reading
+ * past end.  Returns 1 if OK.
+ */
+static int
+replay_parse_id(const char *p, const char *end, replay_mark_t *id)
+{
+    static const char sep[] = ".:)";
+    unsigned long v[3];
+    int i;
+
+    for(i = 0; i < 3; i++) {
+        if(p >= end || !isdigit((unsigned char)*p))
+            return 0;
+        for(v[i] = 0; p < end && isdigit((unsigned char)*p); p++)
+            v[i] = v[i] * 10 + (*p - '0');
+        if(p >= end || *p++ != sep[i])
+            return 0;
+    }
+    id->sec = (time_t)v[0];
+    id->milli = (unsigned)v[1];
+    id->serial = v[2];
+    id->valid = 1;
+    return 1;
+}
+
+/*
+ * Find an event on the open list, adding it if it isn't there.
+ */
+static replay_event_t *
+replay_open_event(const replay_mark_t *id)
+{
+    replay_event_t *ev;
+
+    /* ids mostly arrive in order, so a newer one can't be on the list */
+    if(replay_is_newer(id, &open_max))
+        open_max = *id;
+    else {
+        for(ev = open_tail; ev; ev = ev->prev)
+            if(!replay_cmp(&ev->id, id))
+                return ev;
+    }
+
+    ev = (replay_event_t *)tac_xcalloc(1, sizeof(replay_event_t));
+    ev->id = *id;
+    ev->prev = open_tail;
+    if(open_tail)
+        open_tail->next = ev;
+    else
+        open_head = ev;
+    open_tail = ev;
+    return ev;
+}
+
+/*
+ * Once auparse is done with an event and every record sent for it was
+ * answered, it is no longer open, and the checkpoint may move past it.
+ * Undelivered events stay open, so the next run sends them again.
+ */
+static void
+replay_event_check(replay_event_t *ev)
+{
+    if(!ev->parsed || ev->pending || ev->undelivered)
+        return;
+
+    if(replay_is_newer(&ev->id, &ckpt_mark))
+        ckpt_mark = ev->id;
+
+    if(ev->prev)
+        ev->prev->next = ev->next;
+    else
+        open_head = ev->next;
+    if(ev->next)
+        ev->next->prev = ev->prev;
+    else
+        open_tail = ev->prev;
+    free(ev);
+
+    if(++ckpt_pending >= REPLAY_CKPT_INTERVAL)
+        write_checkpoint();
+}
+
+/*
+ * Add the events with records in buf to the open list, before buf is fed
+ * to auparse.  Records look like
+ *   [node=... ]type=SYSCALL msg=audit(1364481363.243:24287): ...
+ */
+static void
+replay_scan(const char *buf, size_t len)
+{
+    const char *line, *nl, *p, *end = buf + len;
+    replay_mark_t id;
+
+    for(line = buf; line < end; line = nl + 1) {
+        if(!(nl = memchr(line, '\n', end - line)))
+            nl = end;
+        p = memmem(line, nl - line, "msg=audit(", 10);
+        if(p && replay_parse_id(p + 10, nl, &id) &&
+            replay_is_newer(&id, &skip_mark))
+            replay_open_event(&id);
+    }
+}
+
+/*
+ * read() that retries until len bytes are read, or EOF or an error.
+ */
+static ssize_t
+read_full(int fd, void *buf, size_t len)
+{
+    size_t got = 0;
+    ssize_t n;
+
+    while(got < len) {
+        n = read(fd, (char *)buf + got, len - got);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return got ? (ssize_t)got : n;
+        got += n;
+    }
+    return got;
+}
+
+/*
+ * Worker process: send each record it is handed, and report the result.
+ * Each worker has its own copy of the libtac globals, so the workers can
+ * all have a connection to a server open at the same time.
+ */
+static void
+replay_worker(int req_fd, int rep_fd, int idx)
+{
+    struct sigaction sa;
+    replay_req_t req;
+    replay_reply_t rep;
+
+    /* the parent handles signals, and closes our pipe when done */
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    while(read_full(req_fd, &req, sizeof req) == sizeof req) {
+        rep.event = req.event;
+        rep.worker = idx;
+        rep.status = send_tacacs_acct(req.user, req.tty, req.host, req.cmd,
+            req.type, req.taskid, req.evtime);
+        if(write(rep_fd, &rep, sizeof rep) != sizeof rep)
+            break;
+    }
+    _exit(0);
+}
+
+/*
+ * Handle a worker's answer for a record.  Records a server rejected are
+ * logged and skipped, since sending them again won't help.  If no server
+ * could be reached, stop, and leave the event for the next run.
+ */
+static void
+replay_reply_done(const replay_reply_t *rep)
+{
+    replay_event_t *ev = rep->event;
+
+    workers[rep->worker].inflight--;
+    ev->pending--;
+    if(rep->status == ACCT_UNREACHABLE) {
+        if(!replay_failed)
+            replay_msg(LOG_ERR, "stopping replay, no server accepted "
+                "audit(%lu.%03u:%lu)", (unsigned long)ev->id.sec,
+                ev->id.milli, ev->id.serial);
+        ev->undelivered = 1;
+        replay_failed = 1;
+        stop = 1;
+    }
+    else if(rep->status == ACCT_REJECTED) {
+        replay_msg(LOG_WARNING, "skipping audit(%lu.%03u:%lu), rejected by "
+            "the server", (unsigned long)ev->id.sec, ev->id.milli,
+            ev->id.serial);
+        replay_rejected++;
+    }
+    replay_event_check(ev);
+}
+
+/*
+ * Wait up to timeout milliseconds (-1 to wait forever) for an answer from
+ * a worker, and handle it.  Returns 1 if one was handled, 0 on timeout or
+ * once all the workers have exited, and -1 if interrupted by a signal.
+ */
+static int
+replay_read_reply(int timeout)
+{
+    struct pollfd pfd;
+    replay_reply_t rep;
+    int n;
+
+    pfd.fd = reply_fd;
+    pfd.events = POLLIN;
+    n = poll(&pfd, 1, timeout);
+    if(n < 0)
+        return errno == EINTR ? -1 : 0;
+    if(n == 0 || read_full(reply_fd, &rep, sizeof rep) != sizeof rep)
+        return 0;
+    replay_reply_done(&rep);
+    return 1;
+}
+
+/*
+ * Close the request pipes, and collect the answers for everything
+ * already handed out while the workers finish up and exit.
+ */
+static void
+replay_stop_workers(void)
+{
+    int i;
+
+    for(i = 0; i < nworkers; i++)
+        close(workers[i].fd);
+    if(reply_fd >= 0) {
+        while(replay_read_reply(-1))
+            ;
+        close(reply_fd);
+        reply_fd = -1;
+    }
+    for(i = 0; i < nworkers; i++)
+        while(waitpid(workers[i].pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+    nworkers = 0;
+}
+
+/*
+ * Fork the worker processes, each with its own request pipe, and one
+ * pipe shared by all of them for the answers.  Answers are smaller than
+ * PIPE_BUF, so they are never interleaved.  Returns 0 on success.
+ */
+static int
+replay_start_workers(void)
+{
+    int rep[2], req[2], i, j;
+    pid_t pid;
+
+    if(pipe(rep)) {
+        replay_msg(LOG_ERR, "can't create worker pipe: %m");
+        return 1;
+    }
+    for(i = 0; i < replay_jobs; i++) {
+        if(pipe(req))
+            break;
+        if((pid = fork()) < 0) {
+            close(req[0]);
+            close(req[1]);
+            break;
+        }
+        if(pid == 0) {
+            /* only keep our own ends, so each worker sees EOF when closed */
+            for(j = 0; j < i; j++)
+                close(workers[j].fd);
+            close(req[1]);
+            close(rep[0]);
+            replay_worker(req[0], rep[1], i);
+        }
+        close(req[0]);
+        workers[i].pid = pid;
+        workers[i].fd = req[1];
+        workers[i].inflight = 0;
+        nworkers++;
+    }
+    close(rep[1]);
+    reply_fd = rep[0];
+
+    if(nworkers < replay_jobs) {
+        replay_msg(LOG_ERR, "can't start replay workers: %m");
+        replay_stop_workers();
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Hand an accounting record for the event being parsed to a worker.
+ * Records for the same task always go to the same worker, so the start
+ * and stop records of a command are sent in order.  At most
+ * REPLAY_INFLIGHT requests are queued per worker, so the pipes never
+ * fill and neither side blocks writing.  Returns 0 if handed off.
+ */
+static int
+replay_dispatch(char *user, char *tty, char *host, char *cmd, int type,
+    uint16_t taskid, time_t evtime)
+{
+    replay_worker_t *w;
+    replay_req_t req;
+
+    if(!nworkers)
+        return 1;
+    w = &workers[taskid % nworkers];
+    while(w->inflight >= REPLAY_INFLIGHT && !stop)
+        if(!replay_read_reply(-1))
+            return 1; /* workers have gone away */
+    if(stop)
+        return 1;
+
+    memset(&req, 0, sizeof req);
+    req.event = replay_cur;
+    req.type = type;
+    req.taskid = taskid;
+    req.evtime = evtime;
+    snprintf(req.user, sizeof req.user, "%s", user);
+    snprintf(req.tty, sizeof req.tty, "%s", tty);
+    snprintf(req.host, sizeof req.host, "%s", host);
+    snprintf(req.cmd, sizeof req.cmd, "%s", cmd);
+    if(write(w->fd, &req, sizeof req) != sizeof req) {
+        replay_msg(LOG_ERR, "can't hand record to replay worker: %m");
+        replay_failed = 1;
+        stop = 1;
+        return 1;
+    }
+    w->inflight++;
+    replay_cur->pending++;
+    return 0;
+}
+
+/*
+ * Replay the audit log named by --replay.  The file is mapped rather than
+ * read through stdio, and fed to auparse in large chunks ending on a line
+ * boundary, so signals are still noticed between complete records.  The
+ * accounting records are sent by replay_jobs worker processes.
+ * Returns 0 on success, 1 if the log could not be read.
+ */
+static int
+replay_log(auparse_state_t *au)
+{
+    struct stat st;
+    const char *map, *pos, *end, *nl;
+    size_t len;
+    int fd, rv = 0;
+
+    fd = open(replayfile, O_RDONLY);
+    if(fd < 0) {
+        replay_msg(LOG_ERR, "can't open replay file %s: %m", replayfile);
+        return 1;
+    }
+    if(fstat(fd, &st)) {
+        replay_msg(LOG_ERR, "can't stat replay file %s: %m", replayfile);
+        close(fd);
+        return 1;
+    }
+    if(st.st_size == 0) { /* nothing to do, and mmap rejects 0 length */
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        replay_msg(LOG_ERR, "can't map replay file %s: %m", replayfile);
+        return 1;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+    if(debug)
+        syslog(LOG_DEBUG, "%s: replaying %s (%lld bytes) after "
+            "audit(%lu.%03u:%lu) with %d workers", progname, replayfile,
+            (long long)st.st_size, (unsigned long)skip_mark.sec,
+            skip_mark.milli, skip_mark.serial, replay_jobs);
+
+    if(replay_start_workers()) {
+        munmap((void *)map, st.st_size);
+        return 1;
+    }
+
+    for(pos = map, end = map + st.st_size; pos < end && !stop; pos += len) {
+        if(hup) {
+            /* the workers have the old configuration; start new ones */
+            replay_stop_workers();
+            syslog(LOG_NOTICE, "%s re-initializing configuration", progname);
+            reload_config();
+            if(replay_start_workers()) {
+                rv = 1;
+                break;
+            }
+        }
+        len = end - pos;
+        if(len > REPLAY_CHUNK) {
+            len = REPLAY_CHUNK;
+            /* a line longer than the chunk is just split; auparse copes */
+            if((nl = memrchr(pos, '\n', len)))
+                len = nl - pos + 1;
+        }
+        replay_scan(pos, len);
+        auparse_feed(au, pos, len);
+        while(replay_read_reply(0) > 0)
+            ;
+    }
+
+    /*
+     * Only flush at the end of the log.  If we stopped early, the parser
+     * may hold a partial event, which must not be sent as though it were
+     * complete; it is still open, so the next run sends it.
+     */
+    if(!rv && !stop)
+        auparse_flush_feed(au);
+    replay_stop_workers();
+
+    munmap((void *)map, st.st_size);
+    return rv;
+}
+
+/*
+ * Load the last event sent by an earlier replay.  A missing file just
+ * means nothing has been sent yet.  Any other problem is fatal, since
+ * replaying from the start would send duplicates of everything.
+ * Returns 0 on success, 1 on error.
+ */
+static int
+read_checkpoint(void)
+{
+    FILE *ckf;
+    unsigned long sec;
+    int rv = 0;
+
+    if(!checkpointfile)
+        return 0;
+    if(!(ckf = fopen(checkpointfile, "r"))) {
+        if(errno == ENOENT)
+            return 0;
+        replay_msg(LOG_ERR, "can't open checkpoint file %s: %m",
+            checkpointfile);
+        return 1;
+    }
+    if(fscanf(ckf, "%lu.%u:%lu", &sec, &skip_mark.milli,
+            &skip_mark.serial) == 3) {
+        skip_mark.sec = (time_t)sec;
+        skip_mark.valid = 1;
+    }
+    else {
+        replay_msg(LOG_ERR, "malformed checkpoint file %s", checkpointfile);
+        rv = 1;
+    }
+    fclose(ckf);
+    return rv;
+}
+
+/*
+ * The checkpoint to save: the newest event delivered, but kept below the
+ * oldest event still open, so that everything up to it has been handled.
+ * This assumes the log is in order, apart from events still being
+ * assembled, as auditd and ausearch write it.
+ */
+static replay_mark_t
+replay_safe_mark(void)
+{
+    replay_mark_t mark = ckpt_mark;
+    replay_event_t *ev, *oldest = NULL;
+
+    for(ev = open_head; ev; ev = ev->next)
+        if(!oldest || replay_cmp(&ev->id, &oldest->id) < 0)
+            oldest = ev;
+
+    if(oldest && (!mark.valid || replay_cmp(&mark, &oldest->id) >= 0)) {
+        /* just before the oldest open event */
+        mark = oldest->id;
+        if(mark.serial)
+            mark.serial--;
+        else {
+            mark.serial = ULONG_MAX;
+            if(mark.milli)
+                mark.milli--;
+            else {
+                mark.milli = 999;
+                mark.sec--;
+            }
+        }
+    }
+    return mark;
+}
+
+/*
+ * Save the checkpoint.  The data is synced to a temporary file before it
+ * is renamed over the checkpoint, so a crash leaves either the old or the
+ * new checkpoint, never an empty one.  Returns 0 on success.
+ */
+static int
+write_checkpoint(void)
+{
+    FILE *ckf;
+    char tmpname[PATH_MAX];
+    replay_mark_t mark;
+    int err;
+
+    ckpt_pending = 0;
+    if(!checkpointfile)
+        return 0;
+    mark = replay_safe_mark();
+    if(!mark.valid)
+        return 0;
+
+    snprintf(tmpname, sizeof tmpname, "%s.tmp", checkpointfile);
+    if(!(ckf = fopen(tmpname, "w"))) {
+        replay_msg(LOG_ERR, "can't write checkpoint file %s: %m", tmpname);
+        return 1;
+    }
+    fprintf(ckf, "%lu.%03u:%lu\n", (unsigned long)mark.sec, mark.milli,
+        mark.serial);
+    err = fflush(ckf) || fsync(fileno(ckf));
+    if(fclose(ckf) || err || rename(tmpname, checkpointfile)) {
+        replay_msg(LOG_ERR, "can't update checkpoint file %s: %m",
+            checkpointfile);
+        unlink(tmpname);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * evtime is the time the event occurred, used as the start_time
+ * attribute; 0 means now.  Returns one of the ACCT_* values.
+ */
 int
 send_acct_msg(int tac_fd, int type, char *user, char *tty, char *host,
-    char *cmd, uint16_t taskid)
+    char *cmd, uint16_t taskid, time_t evtime)
 {
     char buf[128];
     struct tac_attrib *attr;
-    int retval;
+    int retval, status;
     struct areply re;
 
     attr=(struct tac_attrib *)tac_xcalloc(1, sizeof(struct tac_attrib));
 
-    snprintf(buf, sizeof buf, "%lu", (unsigned long)time(NULL));
+    snprintf(buf, sizeof buf, "%lu", (unsigned long)(evtime ? evtime :
+        time(NULL)));
     tac_add_attrib(&attr, "start_time", buf);
 
     snprintf(buf, sizeof buf, "%hu", taskid);
@@ -350,32 +1072,43 @@ send_acct_msg(int tac_fd, int type, char *user, char *tty, char *host,
     re.msg = NULL;
     retval = tac_acct_send(tac_fd, type, user, tty, host, attr);
 
-    if(retval < 0)
+    if(retval < 0) {
         syslog(LOG_WARNING, "send of accounting msg failed: %m");
-    else if(tac_acct_read(tac_fd, &re) != TAC_PLUS_ACCT_STATUS_SUCCESS ) {
+        retval = ACCT_UNREACHABLE;
+    }
+    else if((status = tac_acct_read(tac_fd, &re)) !=
+        TAC_PLUS_ACCT_STATUS_SUCCESS ) {
         syslog(LOG_WARNING, "accounting msg response failed: %m");
-        retval = -1;
+        /*
+         * libtac returns its own read and protocol errors as negative
+         * values; anything else is the status the server answered with.
+         */
+        retval = status < 0 ? ACCT_UNREACHABLE : ACCT_REJECTED;
     }
+    else
+        retval = ACCT_SENT;
 
     tac_free_attrib(&attr);
     if(re.msg != NULL)
         free(re.msg);
 
-    return retval >= 0 ? 0 : 1;
+    return retval;
 }
 
 /*
  * Send the accounting record to the TACACS+ server.
+ * Returns ACCT_SENT if at least one server accepted the record, otherwise
+ * ACCT_REJECTED if a server answered, or ACCT_UNREACHABLE if none did.
  *
  * We have to make a new connection each time, because libtac is single threaded
  * (doesn't support multiple connects at the same time due to use of globals)),
  * and doesn't have support for persistent connections.
  */
-static void
+static int
 send_tacacs_acct(char *user, char *tty, char *host, char *cmdmsg, int type,
-    uint16_t task_id)
+    uint16_t task_id, time_t evtime)
 {
-    int retval, srv_i, srv_fd;
+    int retval, srv_i, srv_fd, result = ACCT_UNREACHABLE;
 
     for(srv_i = 0; srv_i < tac_srv_no; srv_i++) {
         srv_fd = tac_connect_single(tac_srv[srv_i].addr, tac_srv[srv_i].key,
@@ -386,17 +1119,22 @@ send_tacacs_acct(char *user, char *tty, char *host, char *cmdmsg, int type,
                 tac_ntop(tac_srv[srv_i].addr->ai_addr), srv_fd);
             continue;
         }
-        retval = send_acct_msg(srv_fd, type, user, tty, host, cmdmsg, task_id);
+        retval = send_acct_msg(srv_fd, type, user, tty, host, cmdmsg, task_id,
+            evtime);
         if(retval)
             syslog(LOG_WARNING, "error sending accounting record to %s: %m",
                 tac_ntop(tac_srv[srv_i].addr->ai_addr));
         close(srv_fd);
-        if(!retval) {
+        if(retval == ACCT_SENT) {
             connected_ok = 1;
+            result = ACCT_SENT;
             if(!acct_all)
                 break; /* only send to first responding server */
         }
+        else if(retval == ACCT_REJECTED && result != ACCT_SENT)
+            result = ACCT_REJECTED;
     }
+    return result;
 }
 
 /*
@@ -450,10 +1188,12 @@ get_auval(auparse_state_t *au, const char *field, int *val)
  * we stop at 240 characters, because the longest field tacacs+ can handle
  * is 255 characters, and some of the accounting doesn't seem to work
  * if right at full length.
+ * When replaying, the record is handed to a worker process to send.
+ * Returns non-zero if the record should have been sent but wasn't.
  */
-static void get_acct_record(auparse_state_t *au, int type)
+static int get_acct_record(auparse_state_t *au, int type, time_t evtime)
 {
-    int val, i, llen, tlen, freeloguser=0;
+    int val, i, llen, tlen, freeloguser=0, rv;
     int acct_type;
     pid_t pid;
     uint16_t taskno;
@@ -476,20 +1216,20 @@ static void get_acct_record(auparse_state_t *au, int type)
         acct_type = TAC_PLUS_ACCT_FLAG_STOP;
     }
     else /* not a system call we care about */
-        return;
+        return 0;
 
     auid = session = val = 0;
     if(get_auval(au, "auid", &val))
         auid = (unsigned)val;
     if(auid == 0 || auid == (unsigned)-1) {
         /* we have to have auid for tacplus mapping */
-        return;
+        return 0;
     }
     if(get_auval(au, "ses", &val))
         session = (unsigned)val;
     if(session == 0 || session == (unsigned)-1) {
         /* we have to have session for tacplus mapping */
-        return;
+        return 0;
     }
     if(get_auval(au, "pid", &val)) {
         /*
@@ -520,7 +1260,13 @@ static void get_acct_record(auparse_state_t *au, int type)
      * the NSS library, the username in auser will likely already be the login
      * name.
      */
-    loguser = lookup_logname(NULL, auid, session, &host, NULL);
+    loguser = NULL;
+    /*
+     * Session ids restart at each boot, so when replaying events from an
+     * earlier boot, the current session map could name the wrong user.
+     */
+    if(!evtime || evtime >= boot_time)
+        loguser = lookup_logname(NULL, auid, session, &host, NULL);
     if(!loguser) {
         char *user = NULL;
 
@@ -534,7 +1280,7 @@ static void get_acct_record(auparse_state_t *au, int type)
             }
         }
         if(!user)
-            return; /* must be an invalid record */
+            return 0; /* must be an invalid record */
         loguser = user;
     }
     else {
@@ -605,13 +1351,20 @@ static void get_acct_record(auparse_state_t *au, int type)
      * loguser is always set, we bail if not.  For ANOM_ABEND, tty may be
      *  unknown, and in some cases, host may be not be set.
      */
-    send_tacacs_acct(loguser, tty?tty:"UNK", host?host:"UNK", logbase, acct_type, taskno);
+    if(replay_cur)
+        rv = replay_dispatch(loguser, tty?tty:"UNK", host?host:"UNK", logbase,
+            acct_type, taskno, evtime);
+    else
+        rv = send_tacacs_acct(loguser, tty?tty:"UNK", host?host:"UNK", logbase,
+            acct_type, taskno, evtime);
 
     if(host)
         free(host);
 
     if(freeloguser)
         free(loguser);
+
+    return rv;
 }
 
 /*
@@ -622,12 +1375,34 @@ static void
 handle_event(auparse_state_t *au, auparse_cb_event_t cb_event_type,
              void *user_data __attribute__ ((unused)))
 {
-    int type, num=0;
+    int type, num=0, failed=0;
+    time_t evtime = 0; /* live events are sent as they happen */
+    const au_event_t *ev;
+    replay_mark_t id;
 
     if(cb_event_type != AUPARSE_CB_EVENT_READY) {
 	    return;
     }
 
+    /*
+     * When replaying, skip events sent by an earlier run, and keep the
+     * original event time rather than the time we happen to send it.
+     * Once stopped (signal or send failure), send nothing more; events
+     * not handled stay open, so the next run resumes with them.
+     */
+    if(replayfile) {
+	if(stop || !(ev = auparse_get_timestamp(au)))
+	    return;
+	id.sec = ev->sec;
+	id.milli = ev->milli;
+	id.serial = ev->serial;
+	id.valid = 1;
+	if(!replay_is_newer(&id, &skip_mark))
+	    return;
+	replay_cur = replay_open_event(&id);
+	evtime = ev->sec;
+    }
+
     /* Loop through the records in the event looking for one to process.
      * We use physical record number because we may search around and
      * move the cursor accidentally skipping a record.
@@ -641,7 +1416,7 @@ handle_event(auparse_state_t *au, auparse_cb_event_t cb_event_type,
 	switch(type) {
 	    case AUDIT_SYSCALL:
 	    case AUDIT_ANOM_ABEND:
-		get_acct_record(au, type);
+		failed |= get_acct_record(au, type, evtime);
 		break;
 	    default:
 		// for doublechecking dump_whole_record(au);
@@ -649,4 +1424,12 @@ handle_event(auparse_state_t *au, auparse_cb_event_t cb_event_type,
 	}
 	num++;
     }
+
+    if(replay_cur) {
+	replay_cur->parsed = 1;
+	if(failed) /* not handed to a worker; we are stopping */
+	    replay_cur->undelivered = 1;
+	replay_event_check(replay_cur);
+	replay_cur = NULL;
+    }
 }
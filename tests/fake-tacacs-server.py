@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+#
+# Minimal TACACS+ accounting server, used by replay-test.sh.
+# Each accounting request is appended to the --log file as one line:
+#   user<TAB>tty<TAB>host<TAB>attr=value<TAB>attr=value...
+# The server answers every request with success, except that a request
+# whose cmd contains the --drop string gets the connection closed with no
+# answer (looks like an outage), and one whose cmd contains the --reject
+# string is answered with an error status.
+
+import argparse
+import hashlib
+import os
+import socketserver
+import struct
+import threading
+
+TAC_PLUS_ACCT = 3
+TAC_PLUS_ACCT_STATUS_SUCCESS = 1
+TAC_PLUS_ACCT_STATUS_ERROR = 2
+
+
+def crypt(body, session, key, version, seq):
+    """TACACS+ body obfuscation; the same operation encrypts and decrypts"""
+    out = bytearray()
+    prev = b''
+    while len(out) < len(body):
+        prev = hashlib.md5(session + key + bytes([version, seq]) +
+                           prev).digest()
+        out += prev
+    return bytes(b ^ p for b, p in zip(body, out))
+
+
+def recv_all(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+class Handler(socketserver.BaseRequestHandler):
+    def handle(self):
+        opts = self.server.opts
+        try:
+            hdr = recv_all(self.request, 12)
+        except EOFError:
+            return
+        version, ptype, seq, _flags = hdr[:4]
+        session = hdr[4:8]
+        length = struct.unpack('!I', hdr[8:12])[0]
+        body = crypt(recv_all(self.request, length), session, opts.key,
+                     version, seq)
+        if ptype != TAC_PLUS_ACCT:
+            return
+
+        user_len, port_len, rem_len, argc = body[5:9]
+        arg_lens = body[9:9 + argc]
+        pos = 9 + argc
+        fields = []
+        for n in (user_len, port_len, rem_len) + tuple(arg_lens):
+            fields.append(body[pos:pos + n].decode(errors='replace'))
+            pos += n
+        cmd = next((a[4:] for a in fields[3:] if a.startswith('cmd=')), '')
+
+        if opts.drop and opts.drop in cmd:
+            return
+        with self.server.lock:
+            with open(opts.log, 'a') as log:
+                log.write('\t'.join(fields) + '\n')
+        status = TAC_PLUS_ACCT_STATUS_SUCCESS
+        if opts.reject and opts.reject in cmd:
+            status = TAC_PLUS_ACCT_STATUS_ERROR
+
+        reply = struct.pack('!HHB', 0, 0, status)
+        rhdr = bytes([version, TAC_PLUS_ACCT, seq + 1, 0]) + session + \
+            struct.pack('!I', len(reply))
+        self.request.sendall(rhdr + crypt(reply, session, opts.key,
+                                          version, seq + 1))
+
+
+class Server(socketserver.ThreadingTCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 64
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--key', required=True, type=str.encode)
+    parser.add_argument('--log', required=True)
+    parser.add_argument('--port-file', required=True)
+    parser.add_argument('--drop')
+    parser.add_argument('--reject')
+    opts = parser.parse_args()
+
+    server = Server(('127.0.0.1', 0), Handler)
+    server.opts = opts
+    server.lock = threading.Lock()
+    with open(opts.port_file + '.tmp', 'w') as f:
+        f.write('%d\n' % server.server_address[1])
+    # rename, so the test never reads a partly written port number
+    os.rename(opts.port_file + '.tmp', opts.port_file)
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
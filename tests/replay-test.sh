@@ -0,0 +1,96 @@
+#!/bin/sh
+#
+# Replay tests, run by "make check".  Replays replay-sample.log to a fake
+# TACACS+ accounting server (fake-tacacs-server.py) and checks that:
+#   - records are sent with the original event time as start_time
+#   - an outage stops the replay, and a rerun sends everything that was
+#     missed, including an event auparse was still assembling when the
+#     replay stopped (events 100 and 101 in the log)
+#   - a record the server rejects is skipped, not retried forever
+#   - a rerun after a complete replay sends nothing
+#   - a malformed checkpoint file is an error
+#
+# Usage: replay-test.sh [path-to-audisp-tacplus]
+
+srcdir=$(cd "$(dirname "$0")" && pwd)
+prog=${1:-${AUDISP_TACPLUS:-./audisp-tacplus}}
+tmp=$(mktemp -d)
+server_pid=
+
+cleanup() {
+    [ -n "$server_pid" ] && kill $server_pid 2>/dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# start_server [server options]; writes the accounting config to $tmp/conf
+start_server() {
+    [ -n "$server_pid" ] && kill $server_pid 2>/dev/null
+    rm -f "$tmp/port"
+    python3 "$srcdir/fake-tacacs-server.py" --key testkey \
+        --log "$tmp/received" --port-file "$tmp/port" "$@" &
+    server_pid=$!
+    i=0
+    while [ ! -s "$tmp/port" ]; do
+        i=$((i+1))
+        [ $i -gt 50 ] && fail "fake server didn't start"
+        sleep 0.1
+    done
+    cat > "$tmp/conf" <<EOC
+secret=testkey
+server=127.0.0.1:$(cat "$tmp/port")
+service=shell
+timeout=5
+EOC
+}
+
+replay() {
+    "$prog" --replay "$srcdir/replay-sample.log" --checkpoint "$tmp/ckpt" \
+        "$@" "$tmp/conf" 2>>"$tmp/stderr"
+}
+
+received_cmds() {
+    tr '\t' '\n' < "$tmp/received" | sed -n 's/^cmd=//p' | sort -u
+}
+
+[ -x "$prog" ] || fail "$prog not found"
+if ! command -v python3 >/dev/null; then
+    echo "python3 not found, skipping replay tests"
+    exit 0
+fi
+
+# outage: the server drops the connection for drop-me (event 102), while
+# the earlier held-open event is still being assembled
+start_server --drop drop-me --reject reject-me
+replay --jobs 1 && fail "replay succeeded through an outage"
+grep -q "stopping replay" "$tmp/stderr" || fail "outage not reported"
+[ -s "$tmp/ckpt" ] || fail "no checkpoint written"
+
+# servers back; rerun sends the rest, and reports the rejected record
+start_server --reject reject-me
+replay && fail "rejected record not reported in exit status"
+grep -q "skipping audit(1700000000.107:107)" "$tmp/stderr" ||
+    fail "rejected record not reported"
+received_cmds | diff -u "$srcdir/replay-sample.expected" - ||
+    fail "records missing after rerun"
+grep -v '	start_time=1700000000	' "$tmp/received" | grep -q . &&
+    fail "start_time isn't the original event time"
+grep -q '1700000000.200:200' "$tmp/ckpt" || fail "checkpoint not at end of log"
+
+# complete; nothing more to send
+: > "$tmp/received"
+replay || fail "rerun of completed replay failed"
+[ -s "$tmp/received" ] && fail "rerun sent duplicates"
+
+# malformed checkpoint
+echo garbage > "$tmp/ckpt"
+replay && fail "malformed checkpoint accepted"
+[ -s "$tmp/received" ] && fail "sent records with a malformed checkpoint"
+
+echo "replay tests passed"
+exit 0